@@ -57,6 +57,7 @@ SOFTWARE.
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 typedef int SOCKET;
 #define CLOSESOCKET(s) close(s)
@@ -64,13 +65,16 @@ typedef int SOCKET;
 #endif
 
 #include <cerrno>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -82,6 +86,8 @@ typedef int SOCKET;
 #include "XPLMProcessing.h"
 #include "XPLMUtilities.h"
 
+#include "filters.h"
+
 #ifndef DEBUGWINDOW
 #define DEBUGWINDOW 0
 #endif
@@ -90,6 +96,30 @@ typedef int SOCKET;
 #define DEBUGLOGDATA 0
 #endif
 
+#ifndef INTEGRATESAMPLES
+#define INTEGRATESAMPLES 0
+#endif
+
+// How much of the previous value remains after one second in the smoothing filter. See tunefilter.
+#ifndef FILTER_ALPHA
+#define FILTER_ALPHA 0.5
+#endif
+
+// Whether to use a One Euro filter instead, one that smooths a lot when the head is still and little
+// when it moves fast, 0 or 1. The cutoff frequency is ONEEURO_MINCUTOFF Hz plus ONEEURO_BETA times
+// the speed (in cm/s or degrees/s). See tunefilter.
+#ifndef ONEEURO
+#define ONEEURO 0
+#endif
+
+#ifndef ONEEURO_MINCUTOFF
+#define ONEEURO_MINCUTOFF 0.5
+#endif
+
+#ifndef ONEEURO_BETA
+#define ONEEURO_BETA 0.05
+#endif
+
 #define MYNAME "SymmetricalBroccoli"
 #define MYSIG "fi.iki.tml." MYNAME
 
@@ -351,27 +381,291 @@ static void log_data(const std::string kind, const PoseData &data, float pilot_h
 
 #endif
 
-static void filter_data(double curr_value[6], const double prev_value[6], const float time_diff)
+#if !IBM
+
+// Like recv() on the socket, but also return when the kernel received the packet, or zero if that
+// is not known.
+static long recv_with_timestamp(char *buf, size_t len, struct timeval &arrival)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(struct timeval))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    arrival.tv_sec = 0;
+    arrival.tv_usec = 0;
+
+    long n = recvmsg(sock, &msg, 0);
+    if (n == -1)
+        return n;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP)
+            memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+
+    return n;
+}
+
+#endif
+
+#if INTEGRATESAMPLES
+
+// The samples received since the previous frame. A 1 kHz tracker sends about 33 samples per frame at
+// 30 Hz, so this is plenty even if a frame takes several times longer than normal. If more arrive
+// than fit, the oldest ones get overwritten.
+#define SAMPLE_RING_SIZE 256
+
+static PoseData sample_ring[SAMPLE_RING_SIZE];
+
+// Decimate the samples received during the frame interval to one with a box filter, i.e. average
+// them. This removes the high-frequency motion that would otherwise alias when picking just one.
+static void decimate_samples(PoseData &result, unsigned num_samples)
 {
-    constexpr double ALPHA = 0.5;
+    const unsigned count = num_samples < SAMPLE_RING_SIZE ? num_samples : SAMPLE_RING_SIZE;
+    double sum[6] = { 0, 0, 0, 0, 0, 0 };
+
+    for (unsigned i = 0; i < count; i++)
+        for (int j = 0; j < 6; j++)
+            sum[j] += sample_ring[i].d[j];
+
+    for (int j = 0; j < 6; j++)
+        result.d[j] = sum[j] / count;
+}
+
+#endif
 
-    const double prev_weight = pow(ALPHA, time_diff);
+// Tracing of what happens each frame, written in the Chrome trace format for viewing with
+// chrome://tracing or https://ui.perfetto.dev. Turned on and written from the plug-in menu. When
+// turned off, each trace point costs just the test of trace_enabled.
+
+struct TraceEvent {
+    const char *name;           // Must be a string literal
+    char phase;                 // 'B' (begin), 'E' (end) or 'i' (instant)
+    int counter;                // The flight loop counter, or -1
+    int64_t timestamp;          // Microseconds since tracing was turned on
+};
+
+// Per thread. When full, the oldest events get overwritten.
+#define TRACE_BUFFER_SIZE 65536
+
+struct TraceBuffer {
+    std::vector<TraceEvent> events;
+    uint64_t num_events;
+    int thread_id;
+};
+
+static bool trace_enabled = false;
+static std::chrono::steady_clock::time_point trace_start;
+
+static std::mutex trace_buffers_mutex;
+static std::vector<TraceBuffer *> trace_buffers;
+static thread_local TraceBuffer *trace_buffer;
+
+static TraceBuffer *get_trace_buffer()
+{
+    if (trace_buffer == NULL) {
+        std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+        trace_buffer = new TraceBuffer;
+        trace_buffer->events.resize(TRACE_BUFFER_SIZE);
+        trace_buffer->num_events = 0;
+        trace_buffer->thread_id = static_cast<int>(trace_buffers.size()) + 1;
+        trace_buffers.push_back(trace_buffer);
+    }
+    return trace_buffer;
+}
+
+static int64_t trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+static void trace_record_at(const char *name, char phase, int counter, int64_t timestamp)
+{
+    TraceBuffer *buffer = get_trace_buffer();
+    TraceEvent &event = buffer->events[buffer->num_events++ % TRACE_BUFFER_SIZE];
+
+    event.name = name;
+    event.phase = phase;
+    event.counter = counter;
+    event.timestamp = timestamp;
+}
+
+static void trace_record(const char *name, char phase, int counter)
+{
+    trace_record_at(name, phase, counter, trace_now());
+}
+
+static inline void trace_begin(const char *name, int counter = -1)
+{
+    if (trace_enabled)
+        trace_record(name, 'B', counter);
+}
+
+static inline void trace_end(const char *name, int counter = -1)
+{
+    if (trace_enabled)
+        trace_record(name, 'E', counter);
+}
+
+#if !IBM
+
+// Record when the kernel received a packet. The timestamp is wall clock time, so convert it to the
+// trace clock by how long ago it was. If the wall clock is stepped (by NTP, for instance) between the
+// arrival and now, the arrival time will be off by that step. Packets that arrived before tracing
+// was turned on are not recorded. If there is no timestamp, record when we got the packet.
+static void trace_packet_arrival(const struct timeval &arrival)
+{
+    if (arrival.tv_sec == 0 && arrival.tv_usec == 0) {
+        trace_record("packet dequeued", 'i', -1);
+        return;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const int64_t age = (now.tv_sec - arrival.tv_sec) * static_cast<int64_t>(1000000) + (now.tv_usec - arrival.tv_usec);
+    const int64_t timestamp = trace_now() - age;
+    if (timestamp < 0)
+        return;
+
+    trace_record_at("packet received", 'i', -1, timestamp);
+}
+
+#endif
+
+// Kernel receive timestamps are only asked for while tracing, as reading them costs a bit for each
+// packet
+static void set_socket_timestamps(bool on)
+{
+#if !IBM
+    int value = on;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &value, sizeof(value)) == -1)
+        report_socket_error("setsockopt");
+#endif
+}
 
+static void start_tracing()
+{
+    // Allocate the buffer for this thread, which is the one that calls us back for everything,
+    // now and not in the flight loop
+    get_trace_buffer();
+
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    for (auto buffer : trace_buffers)
+        buffer->num_events = 0;
+
+    set_socket_timestamps(true);
+    trace_start = std::chrono::steady_clock::now();
+    trace_enabled = true;
+    log_string("Tracing started");
+}
+
+static void stop_tracing()
+{
+    trace_enabled = false;
+    set_socket_timestamps(false);
+    log_string("Tracing stopped");
+}
+
+static void write_trace()
+{
+    char filename[512 + 100];
+    XPLMGetSystemPath(filename);
+    time_t now = time(NULL);
+    strftime(filename + strlen(filename), 100, MYNAME ".%F.%H.%M.%S.trace.json", localtime(&now));
+
+    FILE *output = fopen(filename, "w");
+    if (output == NULL) {
+        log_stringf("Could not open %s for writing", filename);
+        return;
+    }
+
+    fprintf(output, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    std::lock_guard<std::mutex> lock(trace_buffers_mutex);
+    uint64_t total = 0;
+    for (auto buffer : trace_buffers) {
+        const uint64_t first = buffer->num_events > TRACE_BUFFER_SIZE ? buffer->num_events - TRACE_BUFFER_SIZE : 0;
+        for (uint64_t i = first; i < buffer->num_events; i++) {
+            const TraceEvent &event = buffer->events[i % TRACE_BUFFER_SIZE];
+            fprintf(output, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d",
+                    total == 0 ? "" : ",\n", event.name, event.phase, static_cast<long long>(event.timestamp), buffer->thread_id);
+            if (event.phase == 'i')
+                fprintf(output, ",\"s\":\"t\"");
+            if (event.counter != -1)
+                fprintf(output, ",\"args\":{\"inCounter\":%d}", event.counter);
+            fprintf(output, "}");
+            total++;
+        }
+    }
+
+    fprintf(output, "\n]}\n");
+    fclose(output);
+
+    log_stringf("Wrote %llu trace events to %s", static_cast<unsigned long long>(total), filename);
+}
+
+#if ONEEURO
+
+// The smoothed speed of each channel, used to adapt the cutoff frequency
+static double filter_speed[6];
+
+static void reset_filter()
+{
     for (int i = 0; i < 6; i++)
-        curr_value[i] = (1 - prev_weight) * curr_value[i] + prev_weight * prev_value[i];
+        filter_speed[i] = 0;
 }
 
-static void get_and_handle_data()
+static void filter_data(double curr_value[6], const double prev_value[6], const float time_diff)
 {
-    PoseData data;
-    long n;
-    bool got_something = false;
+    one_euro_filter(curr_value, prev_value, filter_speed, time_diff, ONEEURO_MINCUTOFF, ONEEURO_BETA);
+}
+
+#else
+
+static void filter_data(double curr_value[6], const double prev_value[6], const float time_diff)
+{
+    exponential_filter(curr_value, prev_value, time_diff, FILTER_ALPHA);
+}
+
+#endif
+
+// Read all buffered data packets. Returns the number of valid ones. With INTEGRATESAMPLES they are
+// put in the ring, otherwise data is the last one. When tracing, also record when each packet
+// arrived, and the drain itself, which is why this is a template: so that the test for tracing is
+// done just once per drain and not for each packet.
+static int recv_errors = 0;
+static int size_errors = 0;
+
+template <bool tracing>
+static unsigned drain_packets(PoseData &data)
+{
+    unsigned num_packets = 0;
+
+    if (tracing)
+        trace_record("drain", 'B', -1);
 
-    current_time = XPLMGetElapsedTime();
-    
-    // Get the most current data packet sent, i.e. read all buffered ones and use only the last.
     while (true) {
-        n = recv(sock, reinterpret_cast<char *>(&data), sizeof(data), 0);
+#if IBM
+        long n = recv(sock, reinterpret_cast<char *>(&data), sizeof(data), 0);
+#else
+        struct timeval arrival;
+        long n;
+        if (tracing)
+            n = recv_with_timestamp(reinterpret_cast<char *>(&data), sizeof(data), arrival);
+        else
+            n = recv(sock, reinterpret_cast<char *>(&data), sizeof(data), 0);
+#endif
         if (n == -1) {
 #if IBM
             if (WSAGetLastError() == WSAEWOULDBLOCK)
@@ -380,29 +674,74 @@ static void get_and_handle_data()
             if (errno == EAGAIN)
                 break;
 #endif
-            static int errors = 0;
-            if (errors <= 10)
+            if (recv_errors <= 10)
                 report_socket_error("recv");
-            if (errors == 10)
+            if (recv_errors == 10)
                 log_string("No further recv errors will be reported");
-            errors++;
-            return;
+            recv_errors++;
+#if INTEGRATESAMPLES
+            // Still use the samples we got so far
+            break;
+#else
+            num_packets = 0;
+            break;
+#endif
         } else if (n != sizeof(data)) {
-            static int errors = 0;
-            if (errors <= 10) {
+            if (size_errors <= 10) {
                 log_stringf("Got %ld bytes, expected %d", n, sizeof(data));
             }
-            if (errors == 10)
+            if (size_errors == 10)
                 log_string("No further data amount discrepancies will be reported");
-            errors++;
-            return;
+            size_errors++;
+#if INTEGRATESAMPLES
+            // Still use the samples we got so far
+            break;
+#else
+            num_packets = 0;
+            break;
+#endif
         } else {
-            got_something = true;
+            if (tracing) {
+#if IBM
+                // There are no kernel receive timestamps here, so this is when we got the packet,
+                // not when it arrived
+                trace_record("packet dequeued", 'i', -1);
+#else
+                trace_packet_arrival(arrival);
+#endif
+            }
+#if INTEGRATESAMPLES
+            sample_ring[num_packets % SAMPLE_RING_SIZE] = data;
+#endif
+            num_packets++;
         }
     }
 
-    if (!got_something)
+    if (tracing)
+        trace_record("drain", 'E', -1);
+
+    return num_packets;
+}
+
+static void get_and_handle_data()
+{
+    PoseData data;
+
+    current_time = XPLMGetElapsedTime();
+    
+#if INTEGRATESAMPLES
+    // Read all buffered data packets into the ring, to be averaged below.
+#else
+    // Get the most current data packet sent, i.e. read all buffered ones and use only the last.
+#endif
+    const unsigned num_packets = trace_enabled ? drain_packets<true>(data) : drain_packets<false>(data);
+
+    if (num_packets == 0)
         return;
+
+#if INTEGRATESAMPLES
+    decimate_samples(data, num_packets);
+#endif
         
     // 1026 is the 3D Cockpit
     if (XPLMGetDatai(view_type) != 1026)
@@ -445,13 +784,18 @@ static void get_and_handle_data()
         first_data = data;
         prev_data = data;
         prev_time = current_time;
+#if ONEEURO
+        reset_filter();
+#endif
 
         input_reset = false;
         return;
     }
 
     const float time_diff = current_time - prev_time;
+    trace_begin("filter");
     filter_data(data.d, prev_data.d, time_diff);
+    trace_end("filter");
 
 #if DEBUGWINDOW
     static char *debug_buf;
@@ -463,18 +807,23 @@ static void get_and_handle_data()
     free(debug_buf);
 #endif
 
+    trace_begin("mapping");
     float pilot_head_x = static_cast<float>((data.d[X] - first_data.d[X]) * X_FACTOR + initial_pilot_head_pos[X]);
     float pilot_head_y = static_cast<float>((data.d[Y] - first_data.d[Y]) * Y_FACTOR + initial_pilot_head_pos[Y]);
     float pilot_head_z = static_cast<float>((data.d[Z] - first_data.d[Z]) * Z_FACTOR + initial_pilot_head_pos[Z]);
     float pilot_head_psi = static_cast<float>((data.d[PSI] - first_data.d[PSI]) * PSI_FACTOR + initial_pilot_head_pos[PSI]);
     float pilot_head_the = static_cast<float>((data.d[THE] - first_data.d[THE]) * THE_FACTOR + initial_pilot_head_pos[THE]);
 
+    trace_end("mapping");
+
+    trace_begin("dataref writes");
     XPLMSetDataf(head_x, pilot_head_x);
     XPLMSetDataf(head_y, pilot_head_y);
     XPLMSetDataf(head_z, pilot_head_z);
     XPLMSetDataf(head_psi, pilot_head_psi);
     XPLMSetDataf(head_the, pilot_head_the);
     // No need to roll the head
+    trace_end("dataref writes");
 
     static int num_logs = 0;
     if (num_logs < 100) {
@@ -495,7 +844,9 @@ static void get_and_handle_data()
 
 static void draw_debug_window_callback(XPLMWindowID in_window_id, void *refcon)
 {
+    trace_begin("draw callback");
     get_and_handle_data();
+    trace_end("draw callback");
 }
 
 #else
@@ -505,7 +856,9 @@ static float flight_loop_callback(float inElapsedSinceLastCall,
                                   int inCounter,    
                                   void *refcon)
 {
+    trace_begin("flight loop", inCounter);
     get_and_handle_data();
+    trace_end("flight loop", inCounter);
 
     return 1.0f/30;
 }
@@ -632,17 +985,32 @@ PLUGIN_API int XPluginStart(char * outName,
     XPLMScheduleFlightLoop(flight_loop_id, 1.0f/30, true);
 #endif
 
-    static int reset_item;
+    static int reset_item, trace_item, write_trace_item;
+    static XPLMMenuID my_menu;
+    static int trace_item_index;
     XPLMMenuID plugins_menu = XPLMFindPluginsMenu();
     int my_submenu_item = XPLMAppendMenuItem(plugins_menu, MYNAME, NULL, 0);
-    XPLMMenuID my_menu = XPLMCreateMenu("", plugins_menu, my_submenu_item,
-                                        [](void *menu, void *item) {
-                                            if (item == &reset_item)
-                                                input_reset = true;
-                                        },
-                                        NULL);
+    my_menu = XPLMCreateMenu("", plugins_menu, my_submenu_item,
+                             [](void *menu, void *item) {
+                                 if (item == &reset_item) {
+                                     input_reset = true;
+                                 } else if (item == &trace_item) {
+                                     if (trace_enabled)
+                                         stop_tracing();
+                                     else
+                                         start_tracing();
+                                     XPLMCheckMenuItem(my_menu, trace_item_index,
+                                                       trace_enabled ? xplm_Menu_Checked : xplm_Menu_Unchecked);
+                                 } else if (item == &write_trace_item) {
+                                     write_trace();
+                                 }
+                             },
+                             NULL);
                                                 
     XPLMAppendMenuItem(my_menu, "Reset", &reset_item, 0);
+    trace_item_index = XPLMAppendMenuItem(my_menu, "Trace", &trace_item, 0);
+    XPLMCheckMenuItem(my_menu, trace_item_index, xplm_Menu_Unchecked);
+    XPLMAppendMenuItem(my_menu, "Write trace", &write_trace_item, 0);
 
     return 1;
 }
@@ -0,0 +1,55 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+
+// The smoothing filters, one frame at a time. Used both by the plug-in and by tunefilter, which
+// must smooth exactly the same way for its results to be valid.
+
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <cmath>
+
+// The cutoff frequency in Hz for smoothing the speed that the One Euro filter adapts to
+constexpr double ONE_EURO_SPEED_CUTOFF = 1.0;
+
+// Exponential smoothing, where alpha is how much of the previous value remains after one second
+static inline void exponential_filter(double curr_value[6], const double prev_value[6], double time_diff,
+                                      double alpha)
+{
+    const double prev_weight = pow(alpha, time_diff);
+
+    for (int i = 0; i < 6; i++)
+        curr_value[i] = (1 - prev_weight) * curr_value[i] + prev_weight * prev_value[i];
+}
+
+// The weight of the new value in an exponential filter with the given cutoff frequency
+static inline double one_euro_weight(double cutoff, double time_diff)
+{
+    constexpr double PI = 3.14159265358979323846;
+
+    const double tau = 1 / (2 * PI * cutoff);
+    return 1 / (1 + tau / time_diff);
+}
+
+// One Euro smoothing, where the cutoff frequency is min_cutoff plus beta times the smoothed speed
+// of the channel. The speeds are kept in filter_speed, which should start out as zeros.
+static inline void one_euro_filter(double curr_value[6], const double prev_value[6], double filter_speed[6],
+                                   double time_diff, double min_cutoff, double beta)
+{
+    if (time_diff <= 0) {
+        for (int i = 0; i < 6; i++)
+            curr_value[i] = prev_value[i];
+        return;
+    }
+
+    const double speed_weight = one_euro_weight(ONE_EURO_SPEED_CUTOFF, time_diff);
+
+    for (int i = 0; i < 6; i++) {
+        const double speed = (curr_value[i] - prev_value[i]) / time_diff;
+        filter_speed[i] = speed_weight * speed + (1 - speed_weight) * filter_speed[i];
+
+        const double weight = one_euro_weight(min_cutoff + beta * fabs(filter_speed[i]), time_diff);
+        curr_value[i] = weight * curr_value[i] + (1 - weight) * prev_value[i];
+    }
+}
+
+#endif
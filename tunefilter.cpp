@@ -0,0 +1,535 @@
+/* -*- tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+
+// Tune the plug-in's smoothing filter offline against head tracker sessions recorded with recvdata.
+//
+// Each session is replayed the way the plug-in sees it: once per frame all the samples that have
+// arrived since the previous frame are drained, the last one (or with -i their average) is used,
+// and it is smoothed with the same code as in the plug-in, from filters.h. Each candidate parameter
+// value is scored on lag (the delay that maximises the cross-correlation between the raw and the
+// smoothed signal, see estimate_lag()) and on residual jitter (the RMS of the second difference of
+// the smoothed signal relative to that of the raw one). The candidates that are not beaten on both
+// scores by some other candidate, i.e. the Pareto front, are printed, followed by the best
+// compromise as lines to paste into the Makefile. With -e the One Euro filter (ONEEURO=1) is tuned
+// instead, over a grid of minimum cutoff and speed coefficient values.
+//
+// The *_FACTOR constants are plain gains applied after the filter. They scale lag not at all and
+// jitter in proportion to the movement itself, so there is nothing to trade off and they are not
+// tuned here.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "filters.h"
+
+// The channels that are actually used by the plug-in: x, y, z, yaw, pitch. Roll is not.
+#define NUM_CHANNELS 5
+
+// How many times larger the variance of the movement in a channel must be than that of its noise for
+// the channel to be measured. On a channel that is just noise the lag estimate means nothing.
+#define MIN_MOTION_TO_NOISE 10
+
+struct Sample {
+    double t;
+    double d[6];
+};
+
+// A session resampled at the plug-in's frame rate. For each frame, whether any data arrived during
+// it, and the data the plug-in would use.
+struct Session {
+    const char *filename;
+    std::vector<bool> got_data;
+    std::vector<std::array<double, 6>> raw;
+};
+
+// A channel of a session that can be measured, i.e. that is long enough for the lag to be estimated
+// and where the raw signal clearly moves more than its noise. All candidates are scored on the same
+// set of these.
+struct Channel {
+    size_t session;
+    int channel;
+    double raw_jitter;
+};
+
+struct Candidate {
+    double alpha;
+    double min_cutoff;
+    double beta;
+    double lag;
+    double jitter;
+};
+
+// A simple work-stealing pool. Each worker has its own queue of task indices that it takes tasks
+// from the back of. When its own queue is empty it steals from the front of the others'. The tasks
+// are all known in advance, so a worker is done when it finds all queues empty.
+
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned num_workers)
+        : num_workers(num_workers), queues(new Queue[num_workers])
+    {
+    }
+
+    void run(size_t num_tasks, const std::function<void(size_t)> &task)
+    {
+        for (size_t i = 0; i < num_tasks; i++)
+            queues[i % num_workers].tasks.push_back(i);
+
+        std::vector<std::thread> threads;
+        for (unsigned w = 0; w < num_workers; w++)
+            threads.emplace_back([this, w, &task]() { work(w, task); });
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    bool pop_own(unsigned w, size_t &result)
+    {
+        std::lock_guard<std::mutex> lock(queues[w].mutex);
+        if (queues[w].tasks.empty())
+            return false;
+        result = queues[w].tasks.back();
+        queues[w].tasks.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned w, size_t &result)
+    {
+        for (unsigned i = 1; i < num_workers; i++) {
+            Queue &victim = queues[(w + i) % num_workers];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                result = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned w, const std::function<void(size_t)> &task)
+    {
+        size_t i;
+        while (pop_own(w, i) || steal(w, i))
+            task(i);
+    }
+
+    const unsigned num_workers;
+    std::unique_ptr<Queue[]> queues;
+};
+
+static bool read_session(const char *filename, std::vector<Sample> &samples)
+{
+    FILE *input = fopen(filename, "r");
+    if (input == NULL) {
+        perror(filename);
+        return false;
+    }
+
+    char line[200];
+    while (fgets(line, sizeof(line), input) != NULL) {
+        Sample s;
+        if (sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+                   &s.t, &s.d[0], &s.d[1], &s.d[2], &s.d[3], &s.d[4], &s.d[5]) == 7)
+            samples.push_back(s);
+    }
+    fclose(input);
+
+    if (samples.empty()) {
+        fprintf(stderr, "%s: No data\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static Session resample_session(const char *filename, const std::vector<Sample> &samples,
+                                double frame_rate, bool integrate)
+{
+    Session session;
+    session.filename = filename;
+
+    const size_t num_frames = static_cast<size_t>(samples.back().t * frame_rate) + 1;
+    std::array<double, 6> current = {};
+    size_t next = 0;
+
+    for (size_t frame = 0; frame < num_frames; frame++) {
+        const double frame_time = (frame + 1) / frame_rate;
+        double sum[6] = { 0, 0, 0, 0, 0, 0 };
+        int count = 0;
+
+        while (next < samples.size() && samples[next].t < frame_time) {
+            for (int j = 0; j < 6; j++) {
+                sum[j] += samples[next].d[j];
+                current[j] = samples[next].d[j];
+            }
+            count++;
+            next++;
+        }
+        if (integrate && count > 0)
+            for (int j = 0; j < 6; j++)
+                current[j] = sum[j] / count;
+
+        session.got_data.push_back(count > 0);
+        session.raw.push_back(current);
+    }
+
+    return session;
+}
+
+// Smooth with a centred moving average over 2 * half_width + 1 frames, i.e. without delaying
+static std::vector<double> centred_average(const std::vector<double> &v, int half_width)
+{
+    const size_t n = v.size();
+    std::vector<double> prefix(n + 1, 0);
+    for (size_t k = 0; k < n; k++)
+        prefix[k + 1] = prefix[k] + v[k];
+
+    std::vector<double> result(n);
+    for (size_t k = 0; k < n; k++) {
+        const size_t first = k >= static_cast<size_t>(half_width) ? k - half_width : 0;
+        const size_t last = std::min(k + half_width + 1, n);
+        result[k] = (prefix[last] - prefix[first]) / (last - first);
+    }
+    return result;
+}
+
+static double mean(const std::vector<double> &v)
+{
+    double sum = 0;
+    for (double x : v)
+        sum += x;
+    return sum / v.size();
+}
+
+// Returns the lag in frames at which filtered best matches raw, i.e. where the cross-correlation of
+// the two (with the means removed) is highest, interpolated between frames with a parabola through
+// the peak and its neighbours. The signals must be at least 2 * max_lag frames long.
+//
+// The correlation is of positions, not velocities, as differencing would amplify the tracker noise.
+// That noise is white, so its contribution to the correlation is a spike at the lag where the
+// filter's impulse response peaks, which is zero, and it would pull the estimate towards no lag at
+// all. So both signals are first smoothed by the same centred moving average, which does not change
+// the delay between them but removes most of the noise. Negative lags are included in the search so
+// that a peak at or near zero lag gets interpolated too.
+static double estimate_lag(const std::vector<double> &raw, const std::vector<double> &filtered,
+                           int max_lag, int smoothing)
+{
+    const size_t n = raw.size();
+
+    std::vector<double> a = centred_average(raw, smoothing);
+    std::vector<double> b = centred_average(filtered, smoothing);
+    const double a_mean = mean(a), b_mean = mean(b);
+    for (size_t k = 0; k < n; k++) {
+        a[k] -= a_mean;
+        b[k] -= b_mean;
+    }
+
+    // correlation[max_lag + lag] is for b delayed by lag frames relative to a
+    std::vector<double> correlation(2 * max_lag + 1);
+    for (int lag = -max_lag; lag <= max_lag; lag++) {
+        const size_t skip = static_cast<size_t>(std::abs(lag));
+        double sum = 0;
+        for (size_t k = 0; k + skip < n; k++)
+            sum += lag >= 0 ? a[k] * b[k + skip] : a[k + skip] * b[k];
+        correlation[max_lag + lag] = sum / (n - skip);
+    }
+
+    const int best = static_cast<int>(std::max_element(correlation.begin(), correlation.end()) - correlation.begin());
+    if (best == 0 || best == 2 * max_lag)
+        return best - max_lag;
+
+    const double left = correlation[best - 1], middle = correlation[best], right = correlation[best + 1];
+    const double denominator = left - 2 * middle + right;
+    if (denominator == 0)
+        return best - max_lag;
+    return best - max_lag + 0.5 * (left - right) / denominator;
+}
+
+static double rms_second_difference(const std::vector<double> &v)
+{
+    double sum = 0;
+    for (size_t k = 2; k < v.size(); k++) {
+        const double d2 = v[k] - 2 * v[k - 1] + v[k - 2];
+        sum += d2 * d2;
+    }
+    return v.size() > 2 ? sqrt(sum / (v.size() - 2)) : 0;
+}
+
+static double variance(const std::vector<double> &v)
+{
+    const double m = mean(v);
+    double sum = 0;
+    for (double x : v)
+        sum += (x - m) * (x - m);
+    return sum / v.size();
+}
+
+// Find the channels that can be measured, from the raw data only. The movement in a channel is taken
+// to be what remains after the same smoothing as in estimate_lag(), and the noise what it removes.
+static std::vector<Channel> measurable_channels(const std::vector<Session> &sessions, int max_lag,
+                                                int smoothing)
+{
+    std::vector<Channel> result;
+
+    for (size_t s = 0; s < sessions.size(); s++) {
+        const Session &session = sessions[s];
+        if (session.raw.size() < 2 * static_cast<size_t>(max_lag))
+            continue;
+
+        std::vector<double> raw_channel(session.raw.size());
+        for (int i = 0; i < NUM_CHANNELS; i++) {
+            for (size_t frame = 0; frame < session.raw.size(); frame++)
+                raw_channel[frame] = session.raw[frame][i];
+
+            std::vector<double> noise = centred_average(raw_channel, smoothing);
+            const double motion_variance = variance(noise);
+            for (size_t frame = 0; frame < noise.size(); frame++)
+                noise[frame] = raw_channel[frame] - noise[frame];
+            const double noise_variance = variance(noise);
+            if (motion_variance == 0 || motion_variance < MIN_MOTION_TO_NOISE * noise_variance)
+                continue;
+
+            const double raw_jitter = rms_second_difference(raw_channel);
+            if (raw_jitter > 0)
+                result.push_back({ s, i, raw_jitter });
+        }
+    }
+
+    return result;
+}
+
+static void evaluate(Candidate &candidate, const std::vector<Session> &sessions,
+                     const std::vector<Channel> &channels, int max_lag, int smoothing, double frame_rate,
+                     bool one_euro)
+{
+    double lag_sum = 0, jitter_sum = 0;
+
+    // The channels are in session order
+    size_t filtered_session = SIZE_MAX;
+    std::vector<std::array<double, 6>> filtered;
+
+    for (const auto &channel : channels) {
+        const Session &session = sessions[channel.session];
+        const size_t num_frames = session.raw.size();
+
+        if (channel.session != filtered_session) {
+            filtered.resize(num_frames);
+
+            // Like get_and_handle_data(): nothing happens in frames without data, and the first
+            // data is used as such.
+            bool started = false;
+            std::array<double, 6> prev = {};
+            std::array<double, 6> filter_speed = {};
+            size_t prev_frame = 0;
+            for (size_t frame = 0; frame < num_frames; frame++) {
+                if (session.got_data[frame]) {
+                    std::array<double, 6> data = session.raw[frame];
+                    const double time_diff = (frame - prev_frame) / frame_rate;
+                    if (started && one_euro)
+                        one_euro_filter(data.data(), prev.data(), filter_speed.data(), time_diff,
+                                        candidate.min_cutoff, candidate.beta);
+                    else if (started)
+                        exponential_filter(data.data(), prev.data(), time_diff, candidate.alpha);
+                    started = true;
+                    prev = data;
+                    prev_frame = frame;
+                }
+                filtered[frame] = prev;
+            }
+            filtered_session = channel.session;
+        }
+
+        std::vector<double> raw_channel(num_frames), filtered_channel(num_frames);
+        for (size_t frame = 0; frame < num_frames; frame++) {
+            raw_channel[frame] = session.raw[frame][channel.channel];
+            filtered_channel[frame] = filtered[frame][channel.channel];
+        }
+
+        lag_sum += estimate_lag(raw_channel, filtered_channel, max_lag, smoothing) / frame_rate;
+        jitter_sum += rms_second_difference(filtered_channel) / channel.raw_jitter;
+    }
+
+    candidate.lag = lag_sum / channels.size();
+    candidate.jitter = jitter_sum / channels.size();
+}
+
+static std::vector<Candidate> pareto_front(std::vector<Candidate> candidates)
+{
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) {
+                  return a.lag < b.lag || (a.lag == b.lag && a.jitter < b.jitter);
+              });
+
+    std::vector<Candidate> front;
+    for (const auto &candidate : candidates)
+        if (front.empty() || candidate.jitter < front.back().jitter)
+            front.push_back(candidate);
+
+    return front;
+}
+
+// The point on the front closest to the ideal of no lag and no jitter, when both are scaled to the
+// range they have on the front.
+static const Candidate &best_compromise(const std::vector<Candidate> &front)
+{
+    const double lag_range = std::max(front.back().lag - front.front().lag, 1e-9);
+    const double jitter_range = std::max(front.front().jitter - front.back().jitter, 1e-9);
+
+    size_t best = 0;
+    double best_distance = INFINITY;
+    for (size_t i = 0; i < front.size(); i++) {
+        const double l = (front[i].lag - front.front().lag) / lag_range;
+        const double j = (front[i].jitter - front.back().jitter) / jitter_range;
+        const double distance = l * l + j * j;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = i;
+        }
+    }
+    return front[best];
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-r frame-rate] [-i] [-e] [-n candidates] [-j threads] file.csv...\n"
+            "  -r  The rate at which the plug-in handles data, default 30\n"
+            "  -i  Average all samples received during a frame, like INTEGRATESAMPLES=1\n"
+            "  -e  Tune the One Euro filter, used with ONEEURO=1\n"
+            "  -n  The number of filter parameter values to try, default 200\n"
+            "  -j  The number of threads to use, default all cores\n",
+            argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double frame_rate = 30;
+    bool integrate = false;
+    bool one_euro = false;
+    int num_candidates = 200;
+    int num_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:ien:j:")) != -1) {
+        switch (opt) {
+        case 'r':
+            frame_rate = atof(optarg);
+            break;
+        case 'i':
+            integrate = true;
+            break;
+        case 'e':
+            one_euro = true;
+            break;
+        case 'n':
+            num_candidates = atoi(optarg);
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || frame_rate <= 0 || num_candidates < 2 || num_threads <= 0)
+        usage(argv[0]);
+
+    std::vector<Session> sessions;
+    for (int i = optind; i < argc; i++) {
+        std::vector<Sample> samples;
+        if (!read_session(argv[i], samples))
+            return 1;
+        sessions.push_back(resample_session(argv[i], samples, frame_rate, integrate));
+        fprintf(stderr, "%s: %zu samples, %zu frames\n", argv[i], samples.size(), sessions.back().raw.size());
+    }
+
+    const int max_lag = static_cast<int>(2 * frame_rate);
+    // Smooth over about a quarter of a second when estimating lag
+    const int smoothing = std::max(static_cast<int>(frame_rate / 8), 1);
+    const std::vector<Channel> channels = measurable_channels(sessions, max_lag, smoothing);
+    for (size_t i = 0; i < sessions.size(); i++) {
+        const int count = static_cast<int>(std::count_if(channels.begin(), channels.end(),
+                                                         [i](const Channel &channel) { return channel.session == i; }));
+        fprintf(stderr, "%s: %d of %d channels can be measured\n", sessions[i].filename, count, NUM_CHANNELS);
+    }
+    if (channels.empty()) {
+        fprintf(stderr, "No session is long enough (%.0f s) and has clear movement to measure\n", 2.0 * max_lag / frame_rate);
+        return 1;
+    }
+
+    std::vector<Candidate> candidates;
+    if (one_euro) {
+        // A square grid of minimum cutoffs from 0.05 to 5 Hz and speed coefficients from 0.001 to
+        // 1, both on a log scale
+        const int n = std::max(static_cast<int>(sqrt(num_candidates)), 2);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < n; j++) {
+                Candidate candidate = {};
+                candidate.min_cutoff = 0.05 * pow(100, static_cast<double>(i) / (n - 1));
+                candidate.beta = 0.001 * pow(1000, static_cast<double>(j) / (n - 1));
+                candidates.push_back(candidate);
+            }
+        }
+    } else {
+        // ALPHA is how much of the previous value remains after one second, so the interesting
+        // values are spread over several orders of magnitude.
+        for (int i = 0; i < num_candidates; i++) {
+            Candidate candidate = {};
+            candidate.alpha = pow(10, -6 + 6.0 * i / num_candidates);
+            candidates.push_back(candidate);
+        }
+    }
+    num_candidates = static_cast<int>(candidates.size());
+
+    std::atomic<int> num_done(0);
+    WorkStealingPool pool(static_cast<unsigned>(std::min(static_cast<size_t>(num_threads), candidates.size())));
+    pool.run(candidates.size(),
+             [&](size_t i) {
+                 evaluate(candidates[i], sessions, channels, max_lag, smoothing, frame_rate, one_euro);
+                 const int done = ++num_done;
+                 if (done % 10 == 0)
+                     fprintf(stderr, "\r%d/%d", done, num_candidates);
+             });
+    fprintf(stderr, "\n");
+
+    const std::vector<Candidate> front = pareto_front(candidates);
+
+    if (one_euro) {
+        printf("min_cutoff,beta,lag_ms,jitter\n");
+        for (const auto &candidate : front)
+            printf("%.4g,%.4g,%.1f,%.4f\n", candidate.min_cutoff, candidate.beta, candidate.lag * 1000, candidate.jitter);
+    } else {
+        printf("alpha,lag_ms,jitter\n");
+        for (const auto &candidate : front)
+            printf("%.6g,%.1f,%.4f\n", candidate.alpha, candidate.lag * 1000, candidate.jitter);
+    }
+
+    const Candidate &best = best_compromise(front);
+    printf("\n# Lag %.1f ms, jitter %.4f of unfiltered\n", best.lag * 1000, best.jitter);
+    if (one_euro)
+        printf("ONEEURO=1\nONEEURO_MINCUTOFF=%.4g\nONEEURO_BETA=%.4g\n", best.min_cutoff, best.beta);
+    else
+        printf("FILTER_ALPHA=%.6g\n", best.alpha);
+
+    return 0;
+}